@@ -0,0 +1,936 @@
+/*
+ * uftp_lib.c - client side session library for the UDP FTP server
+ * see uftp_lib.h for the request API
+ *
+ * Packets to the server go out one at a time, each kept in the session's
+ * out slot until it is acked. The slot is shared by all requests. Data of
+ * the request the server is currently reading from goes first, otherwise
+ * the next queued command is sent, so commands reach the server while
+ * earlier requests are still running there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <errno.h>
+
+#include "uftp_lib.h"
+#include "uftp_chunk.h"
+
+#define RESEND_MS 500 // wait this long for an ack before sending a packet again
+#define MAX_RESENDS 5
+// the server timed out if it sends nothing this long while we wait on it
+// longer than the server waits on a client, so requests queued behind one we gave up on still run
+#define SILENCE_MS 4000
+#define HASH_INLINE_MAX (4 << 20) // larger files are only hashed while nothing else is in flight
+
+// where a request is in its exchange with the server
+enum Stage_t {
+	STAGE_QUEUED, // not sent yet
+	STAGE_COMMAND, // command sent, reading the response
+	STAGE_DATA, // put: sending the file, then END
+	STAGE_MANIFEST, // dput: sending chunk hashes and lengths, then END
+	STAGE_NEEDS, // dput: reading the indices of the chunks the server is missing
+	STAGE_CHUNKS, // dput: sending the missing chunks, then END
+	STAGE_RESULT, // put and dput: everything sent, waiting for END or PUT_ERR
+	STAGE_DONE
+};
+
+// hashes and lengths of the chunks of a file, in file order
+struct chunk_list {
+	unsigned char* hashes; // HASH_SIZE bytes per chunk
+	unsigned int* lens;
+	int count;
+	int cap; // entries allocated
+};
+
+struct uftp_xfer {
+	int stage; // enum Stage_t
+	unsigned int wire_id; // request id in the packet trailer
+	unsigned int send_seq; // number of the next packet to the server
+	unsigned int get_seq; // number of the next packet expected from the server
+	int result; // outcome so far, the status once END arrives
+	int retried; // a request is resent once after a fresh handshake
+	FILE* file;
+
+	// for a dput
+	int dput; // sent as dput rather than put
+	struct chunk_list list;
+	int listed; // list has been filled in
+	char* need; // chunks the server asked for
+	int next; // next manifest entry, or chunk, to send
+	long offset; // of chunk next in the file
+	unsigned int left; // bytes of chunk next not sent yet
+};
+
+static long long nowMs(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// copies a payload to out and appends the connection id, request id and packet number
+// returns the length of the datagram
+static int addTrailer(char* out, char* buf, int len, unsigned int conn_id, unsigned int req_id, unsigned int seq) {
+	memcpy(out, buf, len);
+	memcpy(out+len, &conn_id, sizeof(int));
+	memcpy(out+len+4, &req_id, sizeof(int));
+	memcpy(out+len+8, &seq, sizeof(int));
+	return len + UFTP_HDRSIZE;
+}
+
+static void sendHello(struct uftp_session* s) {
+	char buf[UFTP_HDRSIZE+5];
+	int len = addTrailer(buf, "HELLO", strlen("HELLO"), 0, 0, 0);
+
+	sendto(s->sockfd, buf, len, 0, (struct sockaddr *) &s->serveraddr, s->serverlen);
+	s->hello_at = nowMs();
+}
+
+// asks the server for a connection id, the reply is picked up by uftp_poll
+static void startHandshake(struct uftp_session* s) {
+	s->hello_tries = 0;
+	sendHello(s);
+}
+
+static void sendAck(struct uftp_session* s, unsigned int req_id, unsigned int seq) {
+	char buf[UFTP_HDRSIZE+7];
+	int len = addTrailer(buf, "GEN_ACK", strlen("GEN_ACK"), s->conn_id, req_id, seq);
+
+	sendto(s->sockfd, buf, len, 0, (struct sockaddr *) &s->serveraddr, s->serverlen);
+}
+
+// sends the next packet of a request and keeps it in the out slot until it is acked
+static void sendOut(struct uftp_session* s, struct uftp_request* req, char* buf, int len) {
+	struct uftp_xfer* x = req->xfer;
+
+	s->out_seq = x->send_seq++;
+	s->out_len = addTrailer(s->out, buf, len, s->conn_id, x->wire_id, s->out_seq);
+	s->out_req = req;
+	s->out_at = nowMs();
+	s->out_tries = 0;
+	sendto(s->sockfd, s->out, s->out_len, 0, (struct sockaddr *) &s->serveraddr, s->serverlen);
+}
+
+// blocks until the socket is readable or uftp_poll has something due
+static void waitReadable(struct uftp_session* s) {
+	struct timeval tv;
+	fd_set fds;
+	int ms = uftp_timeout(s);
+
+	if (ms < 0) {
+		ms = RESEND_MS;
+	}
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	FD_ZERO(&fds);
+	FD_SET(s->sockfd, &fds);
+	select(s->sockfd + 1, &fds, NULL, NULL, &tv);
+}
+
+struct uftp_session* uftp_open(char* hostname, int portno) {
+	struct uftp_session* s;
+	struct hostent *server;
+
+	/* gethostbyname: get the server's DNS entry */
+	server = gethostbyname(hostname);
+	if (server == NULL) {
+		fprintf(stderr,"ERROR, no such host as %s\n", hostname);
+		return NULL;
+	}
+
+	if ((s = calloc(1, sizeof(struct uftp_session))) == NULL) {
+		return NULL;
+	}
+	s->next_wire_id = 1; // 0 is the handshake
+	s->wait_id = -1;
+
+	/* socket: create the socket */
+	s->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s->sockfd < 0) {
+		perror("ERROR opening socket");
+		free(s);
+		return NULL;
+	}
+
+	/* build the server's Internet address */
+	s->serveraddr.sin_family = AF_INET;
+	bcopy((char *)server->h_addr, (char *)&s->serveraddr.sin_addr.s_addr, server->h_length);
+	s->serveraddr.sin_port = htons(portno);
+	s->serverlen = sizeof(s->serveraddr);
+
+	// a failed handshake clears hello_at without setting conn_id
+	startHandshake(s);
+	while (s->conn_id == 0 && s->hello_at) {
+		waitReadable(s);
+		uftp_poll(s);
+	}
+	if (s->conn_id == 0) {
+		close(s->sockfd);
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+// closes the file and frees the buffers a request used on the wire
+static void releaseXfer(struct uftp_xfer* x) {
+	if (x->file) {
+		fclose(x->file);
+		x->file = NULL;
+	}
+	free(x->list.hashes);
+	free(x->list.lens);
+	free(x->need);
+	x->list.hashes = NULL;
+	x->list.lens = NULL;
+	x->need = NULL;
+}
+
+// frees a request along with anything it collected
+static void freeRequest(struct uftp_request* req) {
+	if (req->xfer) {
+		releaseXfer(req->xfer);
+		free(req->xfer);
+	}
+	free(req->listing);
+	free(req);
+}
+
+void uftp_close(struct uftp_session* s) {
+	struct uftp_request** prev;
+	struct uftp_request* req;
+	int id;
+
+	// requests not sent yet are dropped, those in flight finish on the server before the exit
+	// their callbacks do not run, the caller is done with them
+	s->tail = NULL;
+	for (prev = &s->head; (req = *prev) != NULL; ) {
+		if (req->xfer->stage == STAGE_QUEUED) {
+			*prev = req->next;
+			freeRequest(req);
+		} else {
+			req->cb = NULL;
+			s->tail = req;
+			prev = &req->next;
+		}
+	}
+
+	// tell the server, so it frees the session now rather than once it is idle long enough
+	if (s->conn_id && !s->closed && (id = uftp_submit(s, "exit", NULL, NULL)) >= 0) {
+		uftp_wait(s, id);
+	}
+
+	while ((req = s->head) != NULL) {
+		s->head = req->next;
+		freeRequest(req);
+	}
+	while ((req = s->done) != NULL) {
+		s->done = req->next;
+		freeRequest(req);
+	}
+
+	close(s->sockfd);
+	free(s);
+}
+
+// requests the server has been sent but has not finished
+static int inFlight(struct uftp_session* s, int type) {
+	struct uftp_request* req;
+	int count = 0;
+
+	for (req = s->head; req != NULL; req = req->next) {
+		if (req->xfer->stage != STAGE_QUEUED && req->xfer->stage != STAGE_DONE
+			&& (type == UFTP_NONE || req->type == type)) {
+			count++;
+		}
+	}
+	return count;
+}
+
+// 1 if a request is waiting for the server to send something
+static int waitingOnServer(struct uftp_session* s) {
+	struct uftp_request* req;
+
+	for (req = s->head; req != NULL; req = req->next) {
+		int stage = req->xfer->stage;
+		if (stage == STAGE_COMMAND || stage == STAGE_NEEDS || stage == STAGE_RESULT) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// 1 if a request in flight uses the same local file as req, and one of them writes to it
+static int fileBusy(struct uftp_session* s, struct uftp_request* req) {
+	struct uftp_request* other;
+
+	for (other = s->head; other != NULL && other != req; other = other->next) {
+		int stage = other->xfer->stage;
+		if (stage == STAGE_QUEUED || stage == STAGE_DONE) continue;
+		if ((other->type == UFTP_GET || other->type == UFTP_PUT) && (other->type == UFTP_GET || req->type == UFTP_GET)
+			&& !strcmp(other->file_name, req->file_name)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// marks a request completed, its callback runs once those before it completed too
+static void complete(struct uftp_session* s, struct uftp_request* req, int status) {
+	req->status = status;
+	req->xfer->stage = STAGE_DONE;
+	releaseXfer(req->xfer);
+
+	if (s->out_len && s->out_req == req) {
+		s->out_len = 0;
+	}
+}
+
+// completes every request the server has been sent, e.g. once it stopped answering
+static void failInFlight(struct uftp_session* s, int status) {
+	struct uftp_request* req;
+
+	for (req = s->head; req != NULL; req = req->next) {
+		if (req->xfer->stage != STAGE_QUEUED && req->xfer->stage != STAGE_DONE) {
+			complete(s, req, status);
+		}
+	}
+}
+
+// the server no longer knows our connection, e.g. it restarted
+// requests it was sent are queued again for a new connection, once
+static void resetConnection(struct uftp_session* s) {
+	struct uftp_request* req;
+
+	s->conn_id = 0;
+	s->out_len = 0;
+	s->next_wire_id = 1;
+
+	for (req = s->head; req != NULL; req = req->next) {
+		struct uftp_xfer* x = req->xfer;
+		if (x->stage == STAGE_QUEUED || x->stage == STAGE_DONE) {
+			continue;
+		}
+		if (x->retried++) {
+			complete(s, req, UFTP_SERVERERR);
+			continue;
+		}
+
+		x->stage = STAGE_QUEUED;
+		if (x->file) {
+			fclose(x->file);
+			x->file = NULL;
+		}
+		free(x->need);
+		x->need = NULL;
+		free(req->listing);
+		req->listing = NULL;
+		req->listing_len = 0;
+		req->chunks_sent = 0;
+	}
+}
+
+static int addChunk(unsigned char* data, size_t len, void* arg) {
+	struct chunk_list* list = (struct chunk_list *) arg;
+
+	// grow by doubling, large files have tens of thousands of chunks
+	if (list->count == list->cap) {
+		int cap = list->cap ? 2*list->cap : 64;
+		unsigned char* hashes = realloc(list->hashes, cap * HASH_SIZE);
+		if (hashes) list->hashes = hashes;
+		unsigned int* lens = realloc(list->lens, cap * sizeof(unsigned int));
+		if (lens) list->lens = lens;
+		if (!hashes || !lens) {
+			return -1;
+		}
+		list->cap = cap;
+	}
+
+	sha256(data, len, list->hashes + list->count*HASH_SIZE);
+	list->lens[list->count] = len;
+	list->count++;
+	return 0;
+}
+
+// splits a file into content defined chunks and hashes them, see uftp_chunk.h
+// returns the number of chunks, or -1 if the file could not be read
+static int listChunks(FILE* file, struct chunk_list* list) {
+	rewind(file);
+	return chunkFile(file, addChunk, list);
+}
+
+// sends the command of the oldest queued request
+// returns 1 if it was sent or completed, 0 if it has to wait
+static int startRequest(struct uftp_session* s, struct uftp_request* req) {
+	struct uftp_xfer* x = req->xfer;
+	char cmd[UFTP_BUFSIZE]; // command as sent, put becomes dput on a deduplicating server
+	struct stat st;
+	int in_flight = inFlight(s, UFTP_NONE);
+
+	if (s->closed) {
+		complete(s, req, UFTP_CLOSED);
+		return 1;
+	}
+
+	// nothing is sent behind an exit, the server forgets the connection
+	if (in_flight >= UFTP_WINDOW || inFlight(s, UFTP_EXIT)) {
+		return 0;
+	}
+	if (s->conn_id == 0) {
+		if (!s->hello_at) {
+			startHandshake(s);
+		}
+		return 0;
+	}
+
+	// a get truncates its file when it starts, so it can not overlap a put of the same file
+	if ((req->type == UFTP_PUT || req->type == UFTP_GET) && fileBusy(s, req)) {
+		return 0;
+	}
+
+	// in the case we are PUT/GET, we need a fd for that file
+	if (req->type == UFTP_PUT && x->file == NULL && (x->file = fopen(req->file_name, "r")) == NULL) {
+		complete(s, req, UFTP_NOLOCAL);
+		return 1;
+	}
+	if (req->type == UFTP_GET && x->file == NULL && (x->file = fopen(req->file_name, "w")) == NULL) {
+		complete(s, req, UFTP_NOLOCAL);
+		return 1;
+	}
+
+	if (req->type == UFTP_PUT && s->dedup) {
+		// the whole file is hashed before the server starts waiting for the manifest
+		// hashing blocks, so a large file waits until it would not stall other transfers
+		if (!x->listed) {
+			if (in_flight && !fstat(fileno(x->file), &st) && st.st_size > HASH_INLINE_MAX) {
+				return 0;
+			}
+			if (listChunks(x->file, &x->list) < 0) {
+				complete(s, req, UFTP_NOLOCAL);
+				return 1;
+			}
+			x->listed = 1;
+		}
+		x->dput = 1;
+		snprintf(cmd, UFTP_BUFSIZE, "dput %s", req->file_name);
+	} else {
+		x->dput = 0;
+		strncpy(cmd, req->cmd, UFTP_BUFSIZE);
+	}
+
+	// the server numbers packets from 0 for every request
+	x->wire_id = s->next_wire_id++;
+	x->send_seq = 0;
+	x->get_seq = 0;
+	x->result = UFTP_OK;
+	x->stage = STAGE_COMMAND;
+
+	/* send the message to the server */
+	sendOut(s, req, cmd, strlen(cmd));
+	return 1;
+}
+
+// fills buf with the next packet of a request that is sending to the server
+// returns its length, or -1 if the local file could not be read
+static int nextPacket(struct uftp_request* req, char* buf) {
+	struct uftp_xfer* x = req->xfer;
+	struct chunk_list* list = &x->list;
+	int n, k;
+
+	switch (x->stage) {
+		case STAGE_DATA: {
+			n = fread(buf, 1, UFTP_BUFSIZE, x->file);
+			if (n > 0) return n;
+			if (ferror(x->file)) return -1;
+			x->stage = STAGE_RESULT;
+		} break;
+		case STAGE_MANIFEST: {
+			// as many hash and length entries as fit in a packet
+			for (k = 0; k < UFTP_BUFSIZE/ENTRY_SIZE && x->next < list->count; k++, x->next++) {
+				memcpy(buf + k*ENTRY_SIZE, list->hashes + x->next*HASH_SIZE, HASH_SIZE);
+				memcpy(buf + k*ENTRY_SIZE + HASH_SIZE, &list->lens[x->next], sizeof(int));
+			}
+			if (k) return k*ENTRY_SIZE;
+			x->stage = STAGE_NEEDS;
+		} break;
+		case STAGE_CHUNKS: {
+			// needed chunks in order, each split into packets
+			while (x->left == 0 && x->next < list->count) {
+				if (x->need[x->next]) {
+					if (fseek(x->file, x->offset, SEEK_SET)) return -1;
+					x->left = list->lens[x->next];
+				} else {
+					x->offset += list->lens[x->next++];
+				}
+			}
+			if (x->left > 0) {
+				n = fread(buf, 1, x->left < UFTP_BUFSIZE ? x->left : UFTP_BUFSIZE, x->file);
+				if (n <= 0) return -1;
+				x->left -= n;
+				if (x->left == 0) {
+					x->offset += list->lens[x->next++];
+					req->chunks_sent++;
+				}
+				return n;
+			}
+			x->stage = STAGE_RESULT;
+		} break;
+	}
+
+	// everything is sent, END closes it
+	memcpy(buf, "END", strlen("END"));
+	return strlen("END");
+}
+
+// sends the next packet if nothing is waiting for an ack
+static void fillOut(struct uftp_session* s) {
+	char buf[UFTP_BUFSIZE];
+	struct uftp_request* req;
+	int n;
+
+	while (s->out_len == 0) {
+		// the server is blocked reading the request that is sending, so it goes first
+		for (req = s->head; req != NULL; req = req->next) {
+			int stage = req->xfer->stage;
+			if (stage == STAGE_DATA || stage == STAGE_MANIFEST || stage == STAGE_CHUNKS) break;
+		}
+		if (req) {
+			if ((n = nextPacket(req, buf)) < 0) {
+				complete(s, req, UFTP_NOLOCAL);
+				continue;
+			}
+			sendOut(s, req, buf, n);
+			return;
+		}
+
+		// otherwise the next command, in submission order
+		for (req = s->head; req != NULL && req->xfer->stage != STAGE_QUEUED; req = req->next);
+		if (req == NULL || !startRequest(s, req)) {
+			return;
+		}
+	}
+}
+
+// appends a name sent by the server to the listing of an LS request
+static void appendListing(struct uftp_request* req, char* buf, int n) {
+	char* listing = realloc(req->listing, req->listing_len + n + 1);
+	if (listing == NULL) {
+		return;
+	}
+	memcpy(listing + req->listing_len, buf, n);
+	req->listing_len += n;
+	listing[req->listing_len] = '\0';
+	req->listing = listing;
+}
+
+// processes the next packet the server sent for a request
+static void handleResponse(struct uftp_session* s, struct uftp_request* req, char* buf, int n) {
+	struct uftp_xfer* x = req->xfer;
+	unsigned int idx;
+	int i;
+
+	switch (x->stage) {
+		case STAGE_COMMAND: break;
+		case STAGE_NEEDS: {
+			// indices are 4 bytes each, so END and PUT_ERR can not be confused with them
+			if (n == strlen("END") && !strcmp(buf, "END")) {
+				x->stage = STAGE_CHUNKS;
+				x->next = 0;
+				x->offset = 0;
+				x->left = 0;
+				return;
+			}
+			if (n % 4) {
+				complete(s, req, UFTP_SERVERERR);
+				return;
+			}
+			for (i = 0; i < n/4; i++) {
+				memcpy(&idx, buf + i*4, sizeof(int));
+				if (idx >= x->list.count) {
+					complete(s, req, UFTP_SERVERERR);
+					return;
+				}
+				x->need[idx] = 1;
+			}
+		} return;
+		case STAGE_RESULT: {
+			// PUT_ERR is not followed by an END
+			complete(s, req, strcmp(buf, "END") ? UFTP_SERVERERR : x->result);
+		} return;
+		default: {
+			// the server gave up while we were still sending
+			complete(s, req, UFTP_SERVERERR);
+		} return;
+	}
+
+	// server acknowledged exit, END still follows
+	if (!strcmp(buf, "EXIT")) {
+		s->closed = 1;
+		return;
+	}
+
+	// if end signal given, the request is done
+	if (!strcmp(buf, "END")) {
+		complete(s, req, x->result);
+		return;
+	}
+
+	// check what type the original request was, then process
+	switch (req->type) {
+		case UFTP_LS: {
+			appendListing(req, buf, n);
+		} break;
+		case UFTP_GET: {
+			// check if NOFILE flag was sent
+			if (!strncmp(buf, "NOFILE", strlen("NOFILE"))) {
+				x->result = UFTP_NOFILE;
+			} else if (n == strlen("GET_ERR") && !strcmp(buf, "GET_ERR")) {
+				// the server could not reassemble the file, what arrived is incomplete
+				x->result = UFTP_SERVERERR;
+			} else {
+				// write to local file
+				fwrite(buf, n, 1, x->file);
+			}
+		} break;
+		case UFTP_PUT: {
+			// PUT_ERR is not followed by an END
+			if (strncmp(buf, "PUT_ACK", strlen("PUT_ACK"))) {
+				complete(s, req, UFTP_SERVERERR);
+				return;
+			}
+
+			// send data to server
+			// integrity of file has already been checked
+			if (x->dput) {
+				req->chunks_total = x->list.count;
+				req->chunks_sent = 0;
+				if (x->list.count && (x->need = calloc(x->list.count, 1)) == NULL) {
+					complete(s, req, UFTP_SERVERERR);
+					return;
+				}
+				x->next = 0;
+				x->stage = STAGE_MANIFEST;
+			} else {
+				rewind(x->file);
+				x->stage = STAGE_DATA;
+			}
+		} break;
+		case UFTP_DELETE: {
+			// the server does not follow DELETE_ERR with an END
+			if (!strncmp(buf, "DELETE_ERR", strlen("DELETE_ERR"))) {
+				complete(s, req, UFTP_SERVERERR);
+			}
+		} break;
+	}
+}
+
+// processes one datagram from the server
+static void handlePacket(struct uftp_session* s, char* get_buf, int n) {
+	char buf[UFTP_BUFSIZE+1]; // payload, NUL terminated
+	unsigned int conn_id, req_id, seq;
+	struct uftp_request* req;
+	int len, ack;
+
+	// too short to carry a trailer
+	if (n < UFTP_HDRSIZE) {
+		return;
+	}
+	len = n - UFTP_HDRSIZE;
+	memcpy(&conn_id, get_buf+len, sizeof(int));
+	memcpy(&req_id, get_buf+len+4, sizeof(int));
+	memcpy(&seq, get_buf+len+8, sizeof(int));
+	memcpy(buf, get_buf, len);
+	buf[len] = '\0';
+	ack = len == strlen("GEN_ACK") && !strcmp(buf, "GEN_ACK");
+
+	// during the handshake we do not have an id yet, so any reply will do
+	if (s->conn_id == 0) {
+		if (s->hello_at && !ack && !strncmp(buf, "HELLO", strlen("HELLO"))) {
+			s->conn_id = conn_id;
+			s->dedup = strstr(buf, "DEDUP") != NULL;
+			s->hello_at = 0;
+			s->heard_at = nowMs();
+		}
+		return;
+	}
+
+	// left over from an earlier connection
+	if (conn_id != s->conn_id) {
+		return;
+	}
+	s->heard_at = nowMs();
+
+	if (ack) {
+		// an ack for an earlier packet is a late duplicate
+		if (s->out_len && req_id == s->out_req->xfer->wire_id && seq == s->out_seq) {
+			s->out_len = 0;
+		}
+		return;
+	}
+
+	if (!strcmp(buf, "BADCONN")) {
+		resetConnection(s);
+		return;
+	}
+
+	for (req = s->head; req != NULL; req = req->next) {
+		if (req->xfer->wire_id == req_id && req->xfer->stage != STAGE_QUEUED && req->xfer->stage != STAGE_DONE) break;
+	}
+
+	// a packet from further ahead can not be sent before this one is acked
+	if (req && seq > req->xfer->get_seq) {
+		return;
+	}
+
+	// acked even if it is a repeat or its request failed, the server waits for it
+	sendAck(s, req_id, seq);
+	if (req == NULL || seq < req->xfer->get_seq) {
+		return;
+	}
+	req->xfer->get_seq++;
+
+	// the server only answers once it has everything we sent for the request
+	if (s->out_len && s->out_req == req) {
+		s->out_len = 0;
+	}
+
+	handleResponse(s, req, buf, len);
+}
+
+// resends what has not been acked and gives up on a server that stopped answering
+static void checkTimers(struct uftp_session* s) {
+	struct uftp_request* req;
+	long long now = nowMs();
+
+	if (s->hello_at && now - s->hello_at >= RESEND_MS) {
+		if (++s->hello_tries > MAX_RESENDS) {
+			// no server, everything waiting for the connection fails
+			s->hello_at = 0;
+			for (req = s->head; req != NULL; req = req->next) {
+				if (req->xfer->stage != STAGE_DONE) {
+					complete(s, req, UFTP_TIMEOUT);
+				}
+			}
+		} else {
+			sendHello(s);
+		}
+	}
+
+	if (s->out_len) {
+		if (now - s->out_at >= RESEND_MS) {
+			// could have been a packet loss, retry unless too many
+			if (++s->out_tries > MAX_RESENDS) {
+				failInFlight(s, UFTP_TIMEOUT);
+			} else {
+				sendto(s->sockfd, s->out, s->out_len, 0, (struct sockaddr *) &s->serveraddr, s->serverlen);
+				s->out_at = now;
+			}
+		}
+	} else if (waitingOnServer(s) && now - s->heard_at >= SILENCE_MS) {
+		failInFlight(s, UFTP_TIMEOUT);
+	}
+}
+
+// hands a completed request to its callback, or keeps it for uftp_wait
+static void finishRequest(struct uftp_session* s, struct uftp_request* req) {
+	if (req->cb) {
+		req->cb(req, req->arg);
+		if (req->id == s->wait_id) {
+			s->wait_done = 1;
+			s->wait_status = req->status;
+		}
+		freeRequest(req);
+	} else {
+		req->next = s->done;
+		s->done = req;
+	}
+}
+
+// finishes completed requests from the front, so they finish in submission order
+static void finishCompleted(struct uftp_session* s) {
+	struct uftp_request* req;
+
+	while ((req = s->head) != NULL && req->xfer->stage == STAGE_DONE) {
+		s->head = req->next;
+		if (s->head == NULL) {
+			s->tail = NULL;
+		}
+		req->next = NULL;
+		finishRequest(s, req);
+	}
+}
+
+int uftp_submit(struct uftp_session* s, char* cmd, uftp_callback cb, void* arg) {
+	struct uftp_request* req;
+
+	if ((req = calloc(1, sizeof(struct uftp_request))) == NULL) {
+		return -1;
+	}
+	if ((req->xfer = calloc(1, sizeof(struct uftp_xfer))) == NULL) {
+		free(req);
+		return -1;
+	}
+	req->id = s->next_id++;
+	req->cb = cb;
+	req->arg = arg;
+	req->status = UFTP_PENDING;
+
+	strncpy(req->cmd, cmd, UFTP_BUFSIZE-1);
+
+	// change ending character to \0
+	req->cmd[strcspn(req->cmd, "\n")] = '\0';
+
+	// get file name if it exists
+	int delimiter = strcspn(req->cmd, " \n");
+	if (req->cmd[delimiter] != '\0') {
+		strncpy(req->file_name, req->cmd+delimiter+1, sizeof(req->file_name)-1);
+	}
+
+	// verify the syntax is correct and set message type
+	if (!strncmp(req->cmd, "ls", strlen("ls"))) {
+		req->type = UFTP_LS;
+	} else if (!strncmp(req->cmd, "delete", strlen("delete"))) {
+		req->type = UFTP_DELETE;
+	} else if (!strncmp(req->cmd, "exit", strlen("exit"))) {
+		req->type = UFTP_EXIT;
+	} else if (!strncmp(req->cmd, "put", strlen("put"))) {
+		req->type = UFTP_PUT;
+
+		// check if file exists
+		if (access(req->file_name, F_OK)) {
+			req->status = UFTP_NOLOCAL;
+		}
+	} else if (!strncmp(req->cmd, "get", strlen("get"))) {
+		req->type = UFTP_GET;
+	} else {
+		// non valid input
+		req->type = UFTP_NONE;
+		req->status = UFTP_BADINPUT;
+	}
+
+	// rejected requests complete in their turn without being sent
+	req->xfer->stage = req->status == UFTP_PENDING ? STAGE_QUEUED : STAGE_DONE;
+
+	// append to the queue
+	if (s->tail) {
+		s->tail->next = req;
+	} else {
+		s->head = req;
+	}
+	s->tail = req;
+
+	fillOut(s);
+	return req->id;
+}
+
+int uftp_fd(struct uftp_session* s) {
+	return s->sockfd;
+}
+
+int uftp_timeout(struct uftp_session* s) {
+	long long now = nowMs();
+	long long due = -1;
+
+	// completed requests are waiting for their callbacks
+	if (s->head && s->head->xfer->stage == STAGE_DONE) {
+		return 0;
+	}
+
+	if (s->hello_at) {
+		due = s->hello_at + RESEND_MS;
+	}
+	if (s->out_len) {
+		if (due < 0 || s->out_at + RESEND_MS < due) due = s->out_at + RESEND_MS;
+	} else if (waitingOnServer(s)) {
+		if (due < 0 || s->heard_at + SILENCE_MS < due) due = s->heard_at + SILENCE_MS;
+	}
+
+	if (due < 0) {
+		return -1;
+	}
+	return due > now ? due - now : 0;
+}
+
+int uftp_poll(struct uftp_session* s) {
+	char buf[UFTP_BUFSIZE+UFTP_HDRSIZE];
+	int n;
+
+	while ((n = recvfrom(s->sockfd, buf, sizeof(buf), MSG_DONTWAIT, NULL, NULL)) >= 0) {
+		handlePacket(s, buf, n);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("ERROR in recvfrom");
+		failInFlight(s, UFTP_SOCKERR);
+	}
+
+	checkTimers(s);
+	fillOut(s);
+	finishCompleted(s);
+	return uftp_pending(s);
+}
+
+int uftp_wait(struct uftp_session* s, int id) {
+	struct uftp_request** prev;
+	struct uftp_request* req;
+	int status;
+
+	s->wait_id = id;
+	s->wait_done = 0;
+	while (1) {
+		uftp_poll(s);
+
+		// completed without a callback, collected here
+		for (prev = &s->done; *prev != NULL; prev = &(*prev)->next) {
+			if ((*prev)->id == id) {
+				req = *prev;
+				*prev = req->next;
+				status = req->status;
+				freeRequest(req);
+				s->wait_id = -1;
+				return status;
+			}
+		}
+
+		// completed and handed to its callback
+		if (s->wait_done) {
+			s->wait_id = -1;
+			return s->wait_status;
+		}
+
+		for (req = s->head; req != NULL && req->id != id; req = req->next);
+		if (req == NULL) {
+			s->wait_id = -1;
+			return UFTP_BADINPUT;
+		}
+
+		waitReadable(s);
+	}
+}
+
+void uftp_drain(struct uftp_session* s) {
+	while (uftp_poll(s) > 0) {
+		waitReadable(s);
+	}
+}
+
+int uftp_pending(struct uftp_session* s) {
+	struct uftp_request* req;
+	int count = 0;
+
+	for (req = s->head; req != NULL; req = req->next) {
+		count++;
+	}
+	return count;
+}
@@ -0,0 +1,161 @@
+/*
+ * uftp_lib.h - client side session library for the UDP FTP server
+ *
+ * Requests are queued on a session with uftp_submit and sent without
+ * waiting for the ones before them to finish, up to UFTP_WINDOW at a time.
+ * Every packet carries the id of the request it belongs to. The server
+ * queues the commands of a session as they arrive and runs them in order,
+ * so the next command is already waiting there when the previous one ends.
+ *
+ * Nothing runs in the background. uftp_poll does whatever work is ready
+ * without blocking, for callers with their own event loop around uftp_fd
+ * and uftp_timeout. uftp_wait and uftp_drain block until requests are done.
+ * The server gives up on a client that does not answer for a few seconds,
+ * so keep polling while requests are in flight.
+ */
+
+#ifndef UFTP_LIB_H
+#define UFTP_LIB_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define UFTP_BUFSIZE 1024
+#define UFTP_HDRSIZE 12 // connection id, request id and packet number appended to every datagram
+
+#define UFTP_WINDOW 8 // requests in flight at once, the server queues as many per session
+
+// keep track of what kind of message was requested
+enum uftp_message_t {
+	UFTP_GET = 0,
+	UFTP_PUT = 1,
+	UFTP_DELETE = 2,
+	UFTP_LS = 3,
+	UFTP_EXIT = 4,
+	UFTP_NONE = -1
+};
+
+// completion status of a request
+enum uftp_status_t {
+	UFTP_OK = 0,
+	UFTP_PENDING = 1,
+	UFTP_BADINPUT = -1, // command could not be parsed
+	UFTP_NOLOCAL = -2, // local file could not be opened
+	UFTP_NOFILE = -3, // file does not exist on the server
+	UFTP_SERVERERR = -4, // server refused or garbled the request
+	UFTP_TIMEOUT = -5, // server stopped responding
+	UFTP_CLOSED = -6, // session was closed before the request ran
+	UFTP_SOCKERR = -7 // the local socket failed, the reason is printed with perror
+};
+
+struct uftp_request;
+
+// progress of a request on the wire, private to uftp_lib.c
+struct uftp_xfer;
+
+// called once a request has completed, successfully or not
+// the request is freed as soon as the callback returns
+typedef void (*uftp_callback)(struct uftp_request* req, void* arg);
+
+struct uftp_request {
+	int id;
+	int type; // enum uftp_message_t
+	int status; // enum uftp_status_t, UFTP_PENDING until the request completes
+	char cmd[UFTP_BUFSIZE];
+	char file_name[256];
+
+	// for LS, the names sent back by the server, space separated
+	char* listing;
+	size_t listing_len;
+
+	// for a PUT to a deduplicating server, chunks in the file and chunks actually sent
+	int chunks_total;
+	int chunks_sent;
+
+	uftp_callback cb;
+	void* arg;
+	struct uftp_xfer* xfer;
+	struct uftp_request* next;
+};
+
+struct uftp_session {
+	int sockfd;
+	struct sockaddr_in serveraddr;
+	int serverlen;
+
+	// handed out by the server on HELLO, 0 until the handshake is done
+	unsigned int conn_id;
+
+	// the server keeps a chunk store, puts only send chunks it is missing
+	int dedup;
+
+	// requests not yet completed, in submission order
+	struct uftp_request* head;
+	struct uftp_request* tail;
+
+	// requests without a callback that completed but were not yet collected by uftp_wait
+	struct uftp_request* done;
+
+	int next_id;
+	int closed; // set once the server acknowledged an exit
+
+	// packet state, only used inside uftp_lib.c
+	unsigned int next_wire_id; // request id the next command is sent under
+	long long heard_at; // when the server last sent anything, in ms
+	long long hello_at; // when HELLO was last sent, 0 unless a handshake is under way
+	int hello_tries;
+
+	// the one packet to the server waiting for its ack, out_len is 0 if there is none
+	char out[UFTP_BUFSIZE+UFTP_HDRSIZE];
+	int out_len;
+	struct uftp_request* out_req;
+	unsigned int out_seq;
+	long long out_at;
+	int out_tries;
+
+	// uftp_wait on a request with a callback, which is freed before uftp_wait sees it
+	int wait_id;
+	int wait_done;
+	int wait_status;
+};
+
+// resolves hostname and opens a session with the server, NULL on failure
+// blocks for the handshake, so the server's features are known from the start
+struct uftp_session* uftp_open(char* hostname, int portno);
+
+// sends exit if the server still has the session, then closes the socket and frees
+// the session along with any queued requests, without running their callbacks
+void uftp_close(struct uftp_session* s);
+
+// queues a command such as "get foo" on the session, and sends it right away
+// if the session has room for another request in flight
+// malformed commands are still queued and complete with UFTP_BADINPUT in order
+// callbacks never run in here, only in uftp_poll, uftp_wait and uftp_drain
+// returns the request id, or -1 if the request could not be allocated
+int uftp_submit(struct uftp_session* s, char* cmd, uftp_callback cb, void* arg);
+
+// the session's socket, becomes readable when uftp_poll has work to do
+int uftp_fd(struct uftp_session* s);
+
+// milliseconds until uftp_poll has work to do even if nothing arrives,
+// e.g. to resend a packet, or -1 if nothing is outstanding
+int uftp_timeout(struct uftp_session* s);
+
+// handles what the server sent, resends what is overdue and sends the next
+// commands, all without blocking
+// callbacks of completed requests run here, in submission order
+// returns the number of requests not yet completed
+int uftp_poll(struct uftp_session* s);
+
+// polls until the request with the given id completes, returns its status
+// requests without a callback are freed here, returns UFTP_BADINPUT for an unknown id
+int uftp_wait(struct uftp_session* s, int id);
+
+// polls until every request has completed
+void uftp_drain(struct uftp_session* s);
+
+// number of requests not yet completed
+int uftp_pending(struct uftp_session* s);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * uftp_chunk.c - content defined chunking shared by client and server
+ * see uftp_chunk.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "uftp_chunk.h"
+
+// random value per byte for the rolling hash, filled in on first use
+// client and server must agree on it, so it comes from a fixed seed
+static uint64_t gear[256];
+static int gear_ready = 0;
+
+static void gearInit(void) {
+	uint64_t x = 0x9E3779B97F4A7C15ULL;
+	int i;
+
+	// splitmix64
+	for (i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		gear[i] = z ^ (z >> 31);
+	}
+	gear_ready = 1;
+}
+
+size_t chunkBoundary(unsigned char* data, size_t len) {
+	uint64_t h = 0;
+	size_t i;
+
+	if (!gear_ready) gearInit();
+
+	if (len <= CHUNK_MIN) {
+		return len;
+	}
+	if (len > CHUNK_MAX) {
+		len = CHUNK_MAX;
+	}
+
+	// each byte shifts older ones out, so h only depends on the last 64 bytes
+	// the top bits are tested since they mix in the most bytes
+	for (i = 0; i < len; i++) {
+		h = (h << 1) + gear[data[i]];
+		if (i >= CHUNK_MIN && !((h >> 52) & CHUNK_MASK)) {
+			return i + 1;
+		}
+	}
+	return len;
+}
+
+int chunkFile(FILE* file, chunk_callback fn, void* arg) {
+	unsigned char* buf;
+	size_t len = 0; // bytes held in buf
+	size_t n;
+	int count = 0;
+
+	if ((buf = malloc(CHUNK_MAX)) == NULL) {
+		return -1;
+	}
+
+	while (1) {
+		// keep a full window so a boundary is never cut short by a read
+		n = fread(buf + len, 1, CHUNK_MAX - len, file);
+		len += n;
+		if (len == 0) break;
+
+		size_t cut = chunkBoundary(buf, len);
+		if (fn(buf, cut, arg)) {
+			free(buf);
+			return -1;
+		}
+		count++;
+
+		memmove(buf, buf + cut, len - cut);
+		len -= cut;
+	}
+
+	free(buf);
+	return ferror(file) ? -1 : count;
+}
+
+/*
+ * sha256 - FIPS 180-4
+ */
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// mixes one 64 byte block into the state
+static void sha256Block(uint32_t state[8], unsigned char* block) {
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = (uint32_t) block[4*i] << 24 | (uint32_t) block[4*i+1] << 16 | (uint32_t) block[4*i+2] << 8 | block[4*i+3];
+	}
+	for (i = 16; i < 64; i++) {
+		uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+
+	for (i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256(unsigned char* data, size_t len, unsigned char hash[HASH_SIZE]) {
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	unsigned char last[128];
+	size_t full = len & ~(size_t) 63;
+	size_t rest = len - full;
+	uint64_t bits = (uint64_t) len * 8;
+	size_t i;
+
+	for (i = 0; i < full; i += 64) {
+		sha256Block(state, data + i);
+	}
+
+	// pad with 0x80, zeros and the length in bits, which may spill into a second block
+	size_t padded = rest < 56 ? 64 : 128;
+	memset(last, 0, sizeof(last));
+	memcpy(last, data + full, rest);
+	last[rest] = 0x80;
+	for (i = 0; i < 8; i++) {
+		last[padded - 1 - i] = bits >> (8 * i);
+	}
+	sha256Block(state, last);
+	if (padded == 128) {
+		sha256Block(state, last + 64);
+	}
+
+	for (i = 0; i < 8; i++) {
+		hash[4*i] = state[i] >> 24;
+		hash[4*i+1] = state[i] >> 16;
+		hash[4*i+2] = state[i] >> 8;
+		hash[4*i+3] = state[i];
+	}
+}
+
+void hashToHex(unsigned char hash[HASH_SIZE], char hex[HASH_HEX_SIZE]) {
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		sprintf(hex + 2*i, "%02x", hash[i]);
+	}
+	hex[2*HASH_SIZE] = '\0';
+}
+
+int hexToHash(char* hex, unsigned char hash[HASH_SIZE]) {
+	unsigned int byte;
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		if (sscanf(hex + 2*i, "%2x", &byte) != 1) {
+			return -1;
+		}
+		hash[i] = byte;
+	}
+	return 0;
+}
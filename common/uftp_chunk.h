@@ -0,0 +1,44 @@
+/*
+ * uftp_chunk.h - content defined chunking shared by client and server
+ *
+ * Files are cut where a rolling hash of the last bytes hits a fixed
+ * pattern, so an edit only changes the chunks around it. Chunks are
+ * named by their SHA-256.
+ */
+
+#ifndef UFTP_CHUNK_H
+#define UFTP_CHUNK_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define CHUNK_MIN 1024
+#define CHUNK_MASK 0xFFF // cut when these hash bits are 0, about every 4 KiB
+#define CHUNK_MAX 16384
+
+#define HASH_SIZE 32
+#define HASH_HEX_SIZE (2*HASH_SIZE + 1)
+
+// one manifest entry on the wire: the chunk hash then its length
+#define ENTRY_SIZE (HASH_SIZE + 4)
+
+// called for every chunk of a file in order, a non zero return stops chunking
+typedef int (*chunk_callback)(unsigned char* data, size_t len, void* arg);
+
+// returns the length of the first chunk of data
+size_t chunkBoundary(unsigned char* data, size_t len);
+
+// splits a file into chunks from its current position to the end
+// returns the number of chunks, or -1 if fn stopped it or the read failed
+int chunkFile(FILE* file, chunk_callback fn, void* arg);
+
+// SHA-256 of data
+void sha256(unsigned char* data, size_t len, unsigned char hash[HASH_SIZE]);
+
+// writes hash as lowercase hex with a terminating \0
+void hashToHex(unsigned char hash[HASH_SIZE], char hex[HASH_HEX_SIZE]);
+
+// parses hex written by hashToHex, returns -1 if it is malformed
+int hexToHash(char* hex, unsigned char hash[HASH_SIZE]);
+
+#endif
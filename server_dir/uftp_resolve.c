@@ -0,0 +1,118 @@
+/*
+ * uftp_resolve.c - cached reverse DNS lookups off the request path
+ * see uftp_resolve.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "uftp_resolve.h"
+
+#define CACHE_SIZE 64 // direct mapped, must be a power of two
+#define QUEUE_SIZE 16 // lookups waiting for the resolver thread
+#define RESOLVE_TTL 300 // seconds before a name is looked up again
+
+enum Entry_t {
+	ENTRY_EMPTY = 0,
+	ENTRY_PENDING = 1, // queued or being looked up
+	ENTRY_DONE = 2, // lookup finished, name may be empty if it failed
+};
+
+struct cache_entry {
+	in_addr_t addr;
+	int state; // enum Entry_t
+	time_t resolved; // when the lookup finished
+	char name[NI_MAXHOST];
+};
+
+static struct cache_entry cache[CACHE_SIZE];
+
+// ring of addresses waiting to be looked up
+static in_addr_t queue[QUEUE_SIZE];
+static int queue_head = 0;
+static int queue_len = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+
+static struct cache_entry* entryFor(in_addr_t addr) {
+	return &cache[(addr ^ (addr >> 16)) & (CACHE_SIZE - 1)];
+}
+
+// resolver thread, looks up queued addresses one at a time
+static void* resolveLoop(void* arg) {
+	struct sockaddr_in sa;
+	char name[NI_MAXHOST];
+	in_addr_t addr;
+
+	while (1) {
+		pthread_mutex_lock(&lock);
+		while (queue_len == 0) {
+			pthread_cond_wait(&queued, &lock);
+		}
+		addr = queue[queue_head];
+		queue_head = (queue_head + 1) % QUEUE_SIZE;
+		queue_len--;
+		pthread_mutex_unlock(&lock);
+
+		// this is the slow part, done without holding the lock
+		bzero(&sa, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr.s_addr = addr;
+		if (getnameinfo((struct sockaddr *) &sa, sizeof(sa), name, sizeof(name), NULL, 0, NI_NAMEREQD)) {
+			name[0] = '\0';
+		}
+
+		pthread_mutex_lock(&lock);
+		struct cache_entry* e = entryFor(addr);
+		// the slot may have been taken over by another address meanwhile
+		if (e->addr == addr && e->state == ENTRY_PENDING) {
+			strncpy(e->name, name, sizeof(e->name));
+			e->state = ENTRY_DONE;
+			e->resolved = time(NULL);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	return NULL;
+}
+
+int resolveInit(void) {
+	pthread_t tid;
+
+	if (pthread_create(&tid, NULL, resolveLoop, NULL)) {
+		return -1;
+	}
+	pthread_detach(tid);
+	return 0;
+}
+
+int resolveLookup(struct in_addr addr, char* name, size_t len) {
+	int found = 0;
+
+	pthread_mutex_lock(&lock);
+	struct cache_entry* e = entryFor(addr.s_addr);
+
+	if (e->addr == addr.s_addr && e->state == ENTRY_DONE && time(NULL) - e->resolved < RESOLVE_TTL) {
+		// failed lookups are cached too so they are not retried every request
+		if (e->name[0] != '\0') {
+			strncpy(name, e->name, len);
+			name[len-1] = '\0';
+			found = 1;
+		}
+	} else if (!(e->addr == addr.s_addr && e->state == ENTRY_PENDING) && queue_len < QUEUE_SIZE) {
+		e->addr = addr.s_addr;
+		e->state = ENTRY_PENDING;
+		queue[(queue_head + queue_len) % QUEUE_SIZE] = addr.s_addr;
+		queue_len++;
+		pthread_cond_signal(&queued);
+	}
+
+	pthread_mutex_unlock(&lock);
+	return found;
+}
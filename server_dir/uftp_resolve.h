@@ -0,0 +1,21 @@
+/*
+ * uftp_resolve.h - cached reverse DNS lookups off the request path
+ *
+ * Lookups run on a background thread. Callers only ever read the cache,
+ * so a slow or failing DNS server never holds up a request.
+ */
+
+#ifndef UFTP_RESOLVE_H
+#define UFTP_RESOLVE_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+
+// starts the resolver thread, returns -1 if it could not be started
+int resolveInit(void);
+
+// copies the cached host name of addr into name and returns 1
+// otherwise queues a lookup for addr and returns 0 without blocking
+int resolveLookup(struct in_addr addr, char* name, size_t len);
+
+#endif
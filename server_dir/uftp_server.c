@@ -1,6 +1,9 @@
 /* 
  * udpserver.c - A simple UDP echo server 
- * usage: udpserver <port>
+ * usage: udpserver <port> [-r] [-d]
+ *
+ * -r resolves client host names for the log on a background thread
+ * -d stores uploads as deduplicated chunks, see uftp_store.h
  */
 
 // Author: Lachlan Murphy
@@ -17,9 +20,63 @@
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <sys/time.h>
+#include <time.h>
 #include <errno.h>
 
+#include "uftp_resolve.h"
+#include "uftp_store.h"
+
 #define BUFSIZE 1024
+#define HDRSIZE 12 // connection id, request id and packet number appended to every datagram
+
+#define SESSION_BITS 6
+#define MAX_SESSIONS (1 << SESSION_BITS)
+#define SESSION_QUEUE 8 // commands a session may have waiting, the client keeps no more in flight
+#define SESSION_IDLE 60 // seconds without a packet before a session's slot may be reused
+
+// a command received from a client but not yet run
+struct command {
+	unsigned int req_id;
+	int len;
+	char text[BUFSIZE+1];
+};
+
+// a client that completed the HELLO handshake
+// the low SESSION_BITS of a connection id are its slot in the session table
+// connection id 0 is reserved for the handshake itself
+//
+// clients send their next commands without waiting for the previous END,
+// each with the next request id. They are acked and queued here as they
+// arrive, whatever the server is doing, and run in order.
+struct session {
+	unsigned int conn_id; // 0 if the slot is free
+	struct sockaddr_in addr; // where the client was last heard from
+	time_t last_seen;
+
+	unsigned int next_req; // request id the client's next command carries
+	struct command queue[SESSION_QUEUE];
+	int queue_head; // oldest command in queue
+	int queue_len;
+
+	// the request being run, packets are numbered from 0 in each direction per request
+	unsigned int req_id;
+	unsigned int send_seq; // number of the next packet to the client
+	unsigned int get_seq; // number of the next packet expected from the client
+};
+
+// one datagram with its trailer split off
+struct packet {
+	char data[BUFSIZE+1]; // payload, NUL terminated
+	int len;
+	unsigned int conn_id;
+	unsigned int req_id;
+	unsigned int seq;
+	int ack; // a GEN_ACK
+	struct sockaddr_in from;
+};
+
+static struct session sessions[MAX_SESSIONS];
+static int dedup = 0; // store uploads in the chunk store
 
 /*
  * error - wrapper for perror
@@ -29,33 +86,93 @@ void error(char *msg) {
 	exit(1);
 }
 
-// sends a packet to an adress
-int sendPacket(char* buf, int len, int sockfd, struct sockaddr_in * clientaddr, int clientlen, unsigned int byte_num);
+// sends the next packet of the session's current request and waits for the ack
+// returns -1 if the client stopped answering
+int sendPacket(char* buf, int len, int sockfd, struct session* sess);
+
+// gets the next packet of the session's current request, -1 on timeout
+// everything else that arrives meanwhile is passed to handleOther
+int getPacket(char* buf, int sockfd, struct session* sess);
+
+// deals with a datagram no one is waiting for: handshakes, unknown connections,
+// new commands to queue and repeats of packets whose ack was lost
+void handleOther(int sockfd, struct packet* pkt);
+
+// takes the oldest command of the next session that has one, NULL if none do
+struct session* nextCommand(struct command* cmd);
+
+// receives a file as chunks, only asking for the ones not already in the store
+// returns -1 if the client timed out or sent data that does not match its manifest
+int putChunked(char* file_name, int sockfd, struct session* sess);
+
+// sets the receive timeout of the socket, 0 for no timeout
+static void setTimeout(int sockfd, int sec, int usec);
 
-// gets a packet
-int getPacket(char* buf, int sockfd, struct sockaddr_in * clientaddr, int clientlen, unsigned int byte_num);
+// reads one datagram and splits off its trailer, returns -1 on timeout
+static int readPacket(int sockfd, struct packet* pkt);
+
+// frees chunks that are no longer used once a recipe was removed or replaced
+void sweepStore(void);
+
+// copies the file name out of a command such as "get foo"
+// returns -1 if it does not fit in size bytes
+int commandName(char* buf, char* file_name, size_t size);
+
+// 1 if a client may use file_name, which has to name a file in the current directory
+// outside the chunk store
+int validName(char* file_name);
+
+// finds the session for a connection id, NULL if it is unknown
+struct session* lookupSession(unsigned int conn_id);
+
+// assigns a connection id to a new client, NULL if every slot is in use
+struct session* newSession(struct sockaddr_in* clientaddr);
 
 
 int main(int argc, char **argv) {
 	int sockfd; /* socket */
 	int portno; /* port to listen on */
-	int clientlen; /* byte size of client's address */
 	struct sockaddr_in serveraddr; /* server's addr */
-	struct sockaddr_in clientaddr; /* client addr */
-	struct hostent *hostp; /* client host info */
-	char buf[BUFSIZE]; /* message buf */
+	char hostname[NI_MAXHOST]; /* client host name, if resolved */
+	char buf[BUFSIZE+1]; /* message buf, one spare byte so a full datagram is still a string */
 	char *hostaddrp; /* dotted decimal host addr string */
 	int optval; /* flag value for setsockopt */
 	int n; /* message byte size */
+	int resolve = 0; /* look up client host names */
+	struct command cmd; /* command being run */
+	struct packet pkt; /* datagram received while idle */
+	struct session* sess; /* session of the current request */
 
 	/* 
 	* check command line arguments 
 	*/
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <port> [-r] [-d]\n", argv[0]);
 		exit(1);
 	}
 	portno = atoi(argv[1]);
+	for (n = 2; n < argc; n++) {
+		if (!strcmp(argv[n], "-r")) {
+			resolve = 1;
+		} else if (!strcmp(argv[n], "-d")) {
+			dedup = 1;
+		} else {
+			fprintf(stderr, "usage: %s <port> [-r] [-d]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	if (dedup && storeInit() < 0) {
+		error("ERROR creating chunk store");
+	}
+
+	if (resolve && resolveInit() < 0) {
+		fprintf(stderr, "Unable to start resolver, host names will not be logged\n");
+		resolve = 0;
+	}
+
+	// connection ids only demultiplex clients, they are not a secret
+	srandom(time(NULL) ^ getpid());
 
 	/* 
 	* socket: create the parent socket 
@@ -87,41 +204,41 @@ int main(int argc, char **argv) {
 			error("ERROR on binding");
 
 	/* 
-	* main loop: wait for a datagram, then echo it
+	* main loop: run queued commands one at a time, and while there are
+	* none wait for datagrams, which queue more
 	*/
-	clientlen = sizeof(clientaddr);
-
-	// keeps track of which packet number we should be recieving
-	unsigned int send_byte_order;
-	unsigned int get_byte_order;
 	while (1) {
+		if ((sess = nextCommand(&cmd)) == NULL) {
+			setTimeout(sockfd, 0, 0);
+			if (readPacket(sockfd, &pkt) == 0) {
+				handleOther(sockfd, &pkt);
+			}
+			continue;
+		}
 
-		/*
-		* recvfrom: receive a UDP datagram from a client
-		*/
-		bzero(buf, BUFSIZE);
-		send_byte_order = 0;
-		get_byte_order = 0;
-		n = getPacket(buf, sockfd, &clientaddr, clientlen, get_byte_order++);
-		printf("%s\n", (char *) &clientaddr.sin_addr.s_addr);
-		/* 
-		* gethostbyaddr: determine who sent the datagram
-		*/
-		hostp = gethostbyaddr((const char *)&clientaddr.sin_addr.s_addr, sizeof(clientaddr.sin_addr.s_addr), AF_INET);
-		if (hostp == NULL) error("ERROR on gethostbyaddr");
-
-		hostaddrp = inet_ntoa(clientaddr.sin_addr);
-		if (hostaddrp == NULL) error("ERROR on inet_ntoa\n");
-
-		printf("server received datagram from %s (%s)\n", hostp->h_name, hostaddrp);
+		// the command was the request's packet 0
+		memcpy(buf, cmd.text, cmd.len + 1);
+		n = cmd.len;
+		sess->req_id = cmd.req_id;
+		sess->send_seq = 0;
+		sess->get_seq = 1;
+
+		hostaddrp = inet_ntoa(sess->addr.sin_addr);
+		if (resolve && resolveLookup(sess->addr.sin_addr, hostname, sizeof(hostname))) {
+			printf("server received datagram from %s (%s) on %08x\n", hostname, hostaddrp, sess->conn_id);
+		} else {
+			printf("server received datagram from %s on %08x\n", hostaddrp, sess->conn_id);
+		}
 		printf("server received %ld/%d bytes: %s\n", strlen(buf), n, buf);
 		
 		// determine what to do with the message
 		if (!strncmp(buf, "exit", strlen("exit"))) {
 			// send EXIT ACK to client
 			strncpy(buf, "EXIT", sizeof(buf));
-			sendPacket(buf, strlen(buf), sockfd, &clientaddr, clientlen, send_byte_order++);
-			sendPacket("END", strlen("END"), sockfd, &clientaddr, clientlen, send_byte_order++);
+			sendPacket(buf, strlen(buf), sockfd, sess);
+			sendPacket("END", strlen("END"), sockfd, sess);
+			sess->conn_id = 0;
+			sess->queue_len = 0;
 		} else if (!strncmp(buf, "ls", strlen("ls"))) {
 			// get all files in current directory
 			DIR *d;
@@ -129,46 +246,92 @@ int main(int argc, char **argv) {
 			d = opendir(".");
 			if (d) {
 				while ((dir = readdir(d)) != NULL) {
+					if (!strcmp(dir->d_name, STORE_DIR)) continue;
+
 					// the space is added here as compared to the client adding it
 					int len = strlen(dir->d_name);
 					memset(dir->d_name+len, ' ', 1);
 					dir->d_name[len+1] = '\0';
-					sendPacket(dir->d_name, strlen(dir->d_name), sockfd, &clientaddr, clientlen, send_byte_order++);
+					sendPacket(dir->d_name, strlen(dir->d_name), sockfd, sess);
 				}
 				closedir(d);
-				sendPacket("END", strlen("END"), sockfd, &clientaddr, clientlen, send_byte_order++);
+				sendPacket("END", strlen("END"), sockfd, sess);
 			}
 		} else if (!strncmp(buf, "get", strlen("get"))) {
 			// get file name if exists
 			char file_name[256];
-			int delimiter = strcspn(buf, " \n\0");
-			strncpy(file_name, buf+delimiter+1, strlen(buf+delimiter+1)+1);
+			int named = commandName(buf, file_name, sizeof(file_name));
 
 			printf("Checking if %s exists...\n", file_name);
-			if (access(file_name, F_OK)) {
+			if (named < 0 || !validName(file_name) || access(file_name, F_OK)) {
 				// file does not exist
 				printf("File %s does not exist.\n", file_name);
-				sendPacket("NOFILE", strlen("NOFILE"), sockfd, &clientaddr, clientlen, send_byte_order++);
-				sendPacket("END", strlen("END"), sockfd, &clientaddr, clientlen, send_byte_order++);
+				sendPacket("NOFILE", strlen("NOFILE"), sockfd, sess);
+				sendPacket("END", strlen("END"), sockfd, sess);
 			} else {
 				printf("File exists. Sending %s\n", file_name);
 				// send file
-				FILE* file = fopen(file_name, "r");
+				FILE* file;
 				int n = 0;
-				while (1) {
-					n = fread(buf, 1, BUFSIZE, file);
-					if (n <= 0) break;
+				if (dedup && (file = recipeOpen(file_name)) != NULL) {
+					// stored as chunks, reassemble it from the store
+					unsigned char hash[HASH_SIZE];
+					unsigned int len;
+					int sent;
+
+					// a damaged file fails the get instead of arriving truncated
+					if (recipeCheck(file) < 0) {
+						n = -1;
+					} else {
+						while ((n = recipeNext(file, hash, &len)) > 0) {
+							FILE* chunk = storeOpenChunk(hash);
+							if (!chunk) {
+								n = -1;
+								break;
+							}
+							sent = 0;
+							while ((n = fread(buf, 1, BUFSIZE, chunk)) > 0) {
+								sendPacket(buf, n, sockfd, sess);
+								sent += n;
+							}
+							fclose(chunk);
+							if (sent != len) {
+								n = -1;
+								break;
+							}
+						}
+					}
+
+					// GET_ERR is followed by END like NOFILE
+					if (n < 0) {
+						fprintf(stderr, "Chunks of %s are missing or damaged\n", file_name);
+						sendPacket("GET_ERR", strlen("GET_ERR"), sockfd, sess);
+					}
+				} else {
+					file = fopen(file_name, "r");
+					while (1) {
+						n = fread(buf, 1, BUFSIZE, file);
+						if (n <= 0) break;
 
-					sendPacket(buf, n, sockfd, &clientaddr, clientlen, send_byte_order++);
+						sendPacket(buf, n, sockfd, sess);
+					}
 				}
-				sendPacket("END", strlen("END"), sockfd, &clientaddr, clientlen, send_byte_order++);
+				sendPacket("END", strlen("END"), sockfd, sess);
 				fclose(file);
 			}
 		} else if (!strncmp(buf, "put", strlen("put"))) {
 			// extract file name
 			char file_name[256];
-			int delimiter = strcspn(buf, " \n\0");
-			strncpy(file_name, buf+delimiter+1, strlen(buf+delimiter+1)+1);
+			int named = commandName(buf, file_name, sizeof(file_name));
+
+			if (named < 0 || !validName(file_name)) {
+				fprintf(stderr, "Refusing to write %s\n", file_name);
+				sendPacket("PUT_ERR", strlen("PUT_ERR"), sockfd, sess);
+				continue;
+			}
+
+			// an existing recipe is replaced, its chunks may become unused
+			int existed = !access(file_name, F_OK);
 
 			// create file
 			FILE* file = fopen(file_name, "w");
@@ -176,15 +339,6 @@ int main(int argc, char **argv) {
 				error("Error creating new file (PUT)");
 			}
 
-			// create timeout for client response
-			struct timeval tv;
-			tv.tv_sec = 0;
-			tv.tv_usec = 500000;
-			if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval)) < 0) {
-				error("ERROR in setsockopt");
-				exit(-1);
-			}
-
 			int ack = 0;
 			// start listening for packets
 			// loop because there may be multiple packets
@@ -194,31 +348,35 @@ int main(int argc, char **argv) {
 
 				// send ack if not already sent
 				if (!ack) {
-					sendPacket("PUT_ACK", strlen("PUT_ACK"), sockfd, &clientaddr, clientlen, send_byte_order++);
+					sendPacket("PUT_ACK", strlen("PUT_ACK"), sockfd, sess);
 					ack = 1;
 				}
 
-				// await response
-				n = getPacket(buf, sockfd, &clientaddr, clientlen, get_byte_order++);
+				// await response, sending clears the timeout so set it each time
+				setTimeout(sockfd, 2, 0);
+				n = getPacket(buf, sockfd, sess);
 
-				// check if err or timeout occured
+				// check if timeout occured
 				if (n < 0) {
-					// check if timoeut
-					if (errno == EAGAIN || errno == EWOULDBLOCK) {
-						// timeout reached
-						fprintf(stderr, "Client Timed out\n");
-						break;
-					} else {
-						// other err
-						error("ERROR in recvfrom");
-					}
+					fprintf(stderr, "Client Timed out\n");
+					fclose(file);
+					break;
 				} else {
 					// check if END is recieved
 					if (!strncmp(buf, "END", strlen("END"))) {
 						fclose(file);
 
+						// plain uploads go into the store too, a file that can not be
+						// chunked is dropped so everything get reassembles is a real recipe
+						if (dedup && storeIngest(file_name) < 0) {
+							fprintf(stderr, "Unable to chunk %s\n", file_name);
+							remove(file_name);
+							sendPacket("PUT_ERR", strlen("PUT_ERR"), sockfd, sess);
+							break;
+						}
+
 						// send END back to client
-						sendPacket("END", strlen("END"), sockfd, &clientaddr, clientlen, send_byte_order++);
+						sendPacket("END", strlen("END"), sockfd, sess);
 						break;
 					}
 
@@ -227,137 +385,512 @@ int main(int argc, char **argv) {
 				}
 			}
 
+			if (dedup && existed) {
+				sweepStore();
+			}
+
 			// reset socket timeout
-			tv.tv_usec = 0;
-			if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval)) < 0) {
-				error("ERROR in setsockopt");
-				exit(-1);
+			setTimeout(sockfd, 0, 0);
+		} else if (dedup && !strncmp(buf, "dput", strlen("dput"))) {
+			// extract file name
+			char file_name[256];
+			int named = commandName(buf, file_name, sizeof(file_name));
+
+			if (named < 0 || !validName(file_name)) {
+				fprintf(stderr, "Refusing to write %s\n", file_name);
+				sendPacket("PUT_ERR", strlen("PUT_ERR"), sockfd, sess);
+				continue;
+			}
+
+			int existed = !access(file_name, F_OK);
+			if (putChunked(file_name, sockfd, sess) < 0) {
+				fprintf(stderr, "Chunked upload of %s failed\n", file_name);
+			} else if (existed) {
+				sweepStore();
 			}
 		} else if (!strncmp(buf, "delete", strlen("delete"))) {
 			// extract file name
 			char file_name[256];
-			int delimiter = strcspn(buf, " \n\0");
-			strncpy(file_name, buf+delimiter+1, strlen(buf+delimiter+1)+1);
+			int named = commandName(buf, file_name, sizeof(file_name));
 
 			// check if file exists
-			if (!access(file_name, F_OK)) {
+			if (named == 0 && validName(file_name) && !access(file_name, F_OK)) {
 				// file exists
 				if (!remove(file_name)) {
-					sendPacket("END", strlen("END"), sockfd, &clientaddr, clientlen, send_byte_order++);
+					sendPacket("END", strlen("END"), sockfd, sess);
+					if (dedup) {
+						sweepStore();
+					}
 				} else {
-					sendPacket("DELETE_ERR", strlen("DELETE_ERR"), sockfd, &clientaddr, clientlen, send_byte_order++);
+					sendPacket("DELETE_ERR", strlen("DELETE_ERR"), sockfd, sess);
 				}
 			} else {
-				sendPacket("DELETE_ERR", strlen("DELETE_ERR"), sockfd, &clientaddr, clientlen, send_byte_order++);
+				sendPacket("DELETE_ERR", strlen("DELETE_ERR"), sockfd, sess);
 			}
 		} else {
 			// command does not exist, shouldn't happen but
 			// its best to put the edge case here
-			sendPacket("BADINPT", strlen("BADINPT"), sockfd, &clientaddr, clientlen, send_byte_order++);
+			sendPacket("BADINPT", strlen("BADINPT"), sockfd, sess);
 		}
 	}
 }
 
-// sends a packet, resends if all bytes were not sent
-int sendPacket(char* buf, int len, int sockfd, struct sockaddr_in * clientaddr, int clientlen, unsigned int byte_num) {
-	char ack_buf[256]; // buffer to get ack
-	char send_buf[BUFSIZE+4]; // extra four bytes to hold packet number
-	int count = 0; // # of times we try to resend the data
-
-	// init send buffer
-	memcpy(send_buf, buf, len);
-
-	// add byte number to buffer
-	// *((unsigned int *) send_buf + len) = byte_num;
-	memcpy(send_buf+len, &byte_num, sizeof(int));
-
-	// set timeout for recvfrom
+// sets the receive timeout of the socket, 0 for no timeout
+static void setTimeout(int sockfd, int sec, int usec) {
 	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 500000; // half a seocond
+	tv.tv_sec = sec;
+	tv.tv_usec = usec;
 	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval)) < 0) {
 		error("ERROR in setsockopt");
 	}
+}
 
-	// for debugging
-	// printf("Sending packet %d %d %d\n", byte_num, *((unsigned int *) send_buf + len), len);
+// orders manifest entries by hash, and by position for equal hashes
+static int compareManifest(const void* a, const void* b) {
+	unsigned char* ha = *(unsigned char **) a;
+	unsigned char* hb = *(unsigned char **) b;
+	int cmp = memcmp(ha, hb, HASH_SIZE);
 
-	// send packet
-	send_packet_lbl:
-	sendto(sockfd, send_buf, len+sizeof(unsigned int), 0, (struct sockaddr *) clientaddr, clientlen);
-	
-	// wait for ACK from other computer
-	socklen_t socklen = sizeof(clientaddr);
-	int n = recvfrom(sockfd, ack_buf, sizeof(ack_buf), 0, (struct sockaddr *) &clientaddr, &socklen);
-	
-	if (n < 0) {
-		// check if timoeut
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			// timeout reached
-			// could have been a packet loss, retry unless too many
-			if (++count > 5) {
-				tv.tv_usec = 0;
-				if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval)) < 0) {
-					error("ERROR in setsockopt");
-				}
-				return -1;
+	if (cmp) return cmp;
+	return ha < hb ? -1 : ha > hb;
+}
+
+int putChunked(char* file_name, int sockfd, struct session* sess) {
+	char buf[BUFSIZE];
+	unsigned char* hashes = NULL; // manifest, HASH_SIZE bytes per chunk
+	unsigned int* lens = NULL; // length of each chunk
+	char* need = NULL; // chunks the client has to send
+	unsigned char** order = NULL; // manifest entries sorted by hash
+	unsigned char* data = NULL; // chunk being received
+	unsigned int idx[BUFSIZE/4]; // indices of needed chunks, one packet worth
+	int count = 0; // chunks in the manifest
+	int cap = 0; // entries allocated in hashes and lens
+	int needed = 0; // chunks the client has to send
+	int bad = 0; // client sent something inconsistent, reply PUT_ERR once it is done
+	int ret = -1;
+	int n, i, j, k;
+
+	sendPacket("PUT_ACK", strlen("PUT_ACK"), sockfd, sess);
+
+	// manifest: packets of hash and length entries, then END
+	while (1) {
+		bzero(buf, BUFSIZE);
+		setTimeout(sockfd, 2, 0);
+		n = getPacket(buf, sockfd, sess);
+		if (n < 0) goto done;
+
+		// entries come in whole multiples of ENTRY_SIZE, so END can not be confused with one
+		if (n == strlen("END") && !strncmp(buf, "END", strlen("END"))) break;
+		if (bad || n % ENTRY_SIZE) {
+			bad = 1;
+			continue;
+		}
+
+		// grow by doubling, large files have tens of thousands of chunks
+		int added = n / ENTRY_SIZE;
+		if (count + added > cap) {
+			int new_cap = cap ? 2*cap : 1024;
+			unsigned char* new_hashes = realloc(hashes, new_cap * HASH_SIZE);
+			if (new_hashes) hashes = new_hashes;
+			unsigned int* new_lens = realloc(lens, new_cap * sizeof(unsigned int));
+			if (new_lens) lens = new_lens;
+			if (!new_hashes || !new_lens) {
+				bad = 1;
+				continue;
 			}
-			
-			goto send_packet_lbl;
-		} else {
-			// other err
-			error("ERROR in recvfrom");
+			cap = new_cap;
+		}
+
+		for (i = 0; i < added; i++) {
+			memcpy(hashes + (count+i)*HASH_SIZE, buf + i*ENTRY_SIZE, HASH_SIZE);
+			memcpy(&lens[count+i], buf + i*ENTRY_SIZE + HASH_SIZE, sizeof(int));
+			if (lens[count+i] == 0 || lens[count+i] > CHUNK_MAX) bad = 1;
 		}
+		count += added;
+	}
+
+	if (bad || (count && ((need = calloc(count, 1)) == NULL || (order = malloc(count * sizeof(unsigned char *))) == NULL))
+		|| (data = malloc(CHUNK_MAX)) == NULL) {
+		sendPacket("PUT_ERR", strlen("PUT_ERR"), sockfd, sess);
+		goto done;
 	}
 
-	// make sure the ACK was recieved
-	if (!strncmp(ack_buf, "GEN_ACK", strlen("GEN_ACK"))) {
-		tv.tv_usec = 0;
-		if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval)) < 0) {
-			error("ERROR in setsockopt");
+	// sort the manifest by hash so repeats of a chunk sit next to each other,
+	// then ask only for the first copy of each chunk the store does not have
+	for (i = 0; i < count; i++) {
+		order[i] = hashes + i*HASH_SIZE;
+	}
+	qsort(order, count, sizeof(unsigned char *), compareManifest);
+	for (i = 0; i < count; i = j) {
+		for (j = i + 1; j < count && !memcmp(order[i], order[j], HASH_SIZE); j++);
+		if (!storeHas(order[i])) {
+			need[(order[i] - hashes) / HASH_SIZE] = 1;
 		}
 	}
-	
-	// reset socket timeout
-	tv.tv_usec = 0;
-	if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (struct timeval *) &tv, sizeof(struct timeval)) < 0) {
-		error("ERROR in setsockopt");
+
+	k = 0;
+	for (i = 0; i < count; i++) {
+		if (!need[i]) continue;
+
+		needed++;
+		idx[k++] = i;
+		if (k == BUFSIZE/4) {
+			sendPacket((char *) idx, k*4, sockfd, sess);
+			k = 0;
+		}
+	}
+	if (k) {
+		sendPacket((char *) idx, k*4, sockfd, sess);
+	}
+	sendPacket("END", strlen("END"), sockfd, sess);
+
+	// needed chunks in manifest order, each one split across packets
+	for (i = 0; i < count; i++) {
+		if (!need[i]) continue;
+
+		unsigned int got = 0;
+		while (got < lens[i]) {
+			setTimeout(sockfd, 2, 0);
+			n = getPacket(buf, sockfd, sess);
+			if (n < 0) goto done;
+			if (n > lens[i] - got) {
+				bad = 1;
+				break;
+			}
+			memcpy(data + got, buf, n);
+			got += n;
+		}
+		if (bad) break;
+
+		if (storeWrite(hashes + i*HASH_SIZE, data, lens[i]) < 0) {
+			bad = 1;
+			break;
+		}
+	}
+
+	// wait for the client's END, anything before it is more data than was asked for
+	while (1) {
+		bzero(buf, BUFSIZE);
+		setTimeout(sockfd, 2, 0);
+		n = getPacket(buf, sockfd, sess);
+		if (n < 0) goto done;
+		if (n == strlen("END") && !strncmp(buf, "END", strlen("END"))) break;
+		bad = 1;
+	}
+
+	if (bad || recipeWrite(file_name, hashes, lens, count) < 0) {
+		sendPacket("PUT_ERR", strlen("PUT_ERR"), sockfd, sess);
+		goto done;
+	}
+
+	printf("Stored %s as %d chunks, %d new\n", file_name, count, needed);
+	sendPacket("END", strlen("END"), sockfd, sess);
+	ret = 0;
+
+	done:
+	setTimeout(sockfd, 0, 0);
+	free(hashes);
+	free(lens);
+	free(need);
+	free(order);
+	free(data);
+	return ret;
+}
+
+void sweepStore(void) {
+	int removed = storeSweep();
+
+	if (removed < 0) {
+		fprintf(stderr, "Unable to read every recipe, unused chunks were kept\n");
+	} else if (removed > 0) {
+		printf("Removed %d unused chunks\n", removed);
+	}
+}
+
+int commandName(char* buf, char* file_name, size_t size) {
+	int delimiter = strcspn(buf, " \n");
+
+	// a command without a name leaves it empty, which validName rejects
+	if (buf[delimiter] == '\0') {
+		file_name[0] = '\0';
+		return 0;
+	}
+	if (snprintf(file_name, size, "%s", buf+delimiter+1) >= size) {
+		return -1;
+	}
+	return 0;
+}
+
+int validName(char* file_name) {
+	if (file_name[0] == '\0' || !strcmp(file_name, ".") || !strcmp(file_name, "..")) {
+		return 0;
+	}
+
+	// no other directories, and nothing that could reach into the chunk store
+	if (strchr(file_name, '/') || !strncmp(file_name, STORE_DIR, strlen(STORE_DIR))) {
+		return 0;
+	}
+	return 1;
+}
+
+struct session* lookupSession(unsigned int conn_id) {
+	struct session* sess = &sessions[conn_id & (MAX_SESSIONS - 1)];
+
+	if (conn_id == 0 || sess->conn_id != conn_id) {
+		return NULL;
+	}
+	return sess;
+}
+
+struct session* newSession(struct sockaddr_in* clientaddr) {
+	struct session* sess = NULL;
+	time_t now = time(NULL);
+	unsigned int conn_id;
+	int i;
+
+	// take a free slot, otherwise one whose client went away without an exit
+	// sessions still in use are never taken over, the new client is refused instead
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (sessions[i].conn_id == 0) {
+			sess = &sessions[i];
+			break;
+		}
+		if (sess == NULL && sessions[i].queue_len == 0 && now - sessions[i].last_seen > SESSION_IDLE) {
+			sess = &sessions[i];
+		}
 	}
+	if (sess == NULL) {
+		return NULL;
+	}
+
+	// random upper bits so a stale id from an evicted client does not match
+	do {
+		conn_id = ((unsigned int) random() << SESSION_BITS) | (sess - sessions);
+	} while (conn_id == 0 || conn_id == sess->conn_id);
+
+	sess->conn_id = conn_id;
+	sess->addr = *clientaddr;
+	sess->last_seen = now;
+	sess->next_req = 1; // 0 is the handshake
+	sess->queue_head = 0;
+	sess->queue_len = 0;
+	sess->req_id = 0;
+	return sess;
+}
+
+// appends the connection id, request id and packet number to a payload
+static int addTrailer(char* buf, int len, unsigned int conn_id, unsigned int req_id, unsigned int seq) {
+	memcpy(buf+len, &conn_id, sizeof(int));
+	memcpy(buf+len+4, &req_id, sizeof(int));
+	memcpy(buf+len+8, &seq, sizeof(int));
+	return len + HDRSIZE;
+}
+
+// sends a single datagram that is not waited on
+static void sendReply(int sockfd, char* msg, struct sockaddr_in* addr, unsigned int conn_id, unsigned int req_id, unsigned int seq) {
+	char send_buf[BUFSIZE+HDRSIZE];
+	int len = strlen(msg);
+
+	memcpy(send_buf, msg, len);
+	len = addTrailer(send_buf, len, conn_id, req_id, seq);
+	sendto(sockfd, send_buf, len, 0, (struct sockaddr *) addr, sizeof(*addr));
+}
 
-	return n;
+// acks a packet, GEN_ACK with the packet's own trailer
+static void sendAck(int sockfd, struct packet* pkt) {
+	sendReply(sockfd, "GEN_ACK", &pkt->from, pkt->conn_id, pkt->req_id, pkt->seq);
 }
 
-int getPacket(char* buf, int sockfd, struct sockaddr_in * clientaddr, int clientlen, unsigned int byte_num) {
-	unsigned int r_byte_num; // recieving pack #
+static int readPacket(int sockfd, struct packet* pkt) {
+	char get_buf[BUFSIZE+HDRSIZE]; // buffer to get data
+	socklen_t socklen;
 	int n; // # of bytes recieved
-	char get_buf[BUFSIZE+4]; // buffer to get data
+
 	do {
-		n = recvfrom(sockfd, get_buf, BUFSIZE + 4, 0, (struct sockaddr *) clientaddr, (socklen_t *) &clientlen);
-		
+		socklen = sizeof(pkt->from);
+		n = recvfrom(sockfd, get_buf, BUFSIZE + HDRSIZE, 0, (struct sockaddr *) &pkt->from, &socklen);
+
 		if (n < 0) {
 			// check if timoeut
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				fprintf(stderr, "Server timed out\n");
 				return -1;
 			} else {
 				// other err
 				error("ERROR in recvfrom");
 			}
 		}
+	} while (n < HDRSIZE); // too short to carry a trailer
+
+	// get connection id, request id and packet number from packet
+	pkt->len = n - HDRSIZE;
+	memcpy(&pkt->conn_id, get_buf+pkt->len, sizeof(int));
+	memcpy(&pkt->req_id, get_buf+pkt->len+4, sizeof(int));
+	memcpy(&pkt->seq, get_buf+pkt->len+8, sizeof(int));
+
+	memcpy(pkt->data, get_buf, pkt->len);
+	pkt->data[pkt->len] = '\0';
+	pkt->ack = pkt->len == strlen("GEN_ACK") && !strcmp(pkt->data, "GEN_ACK");
+	return 0;
+}
 
-		// send ack
-		sendto(sockfd, "GEN_ACK", strlen("GEN_ACK"), 0, (struct sockaddr *) clientaddr, clientlen);
-		
-		// get byte number from packet
-		memcpy(&r_byte_num, get_buf+n-4, sizeof(int));
+void handleOther(int sockfd, struct packet* pkt) {
+	struct session* sess;
+	struct command* cmd;
+
+	// late, or for a packet that was given up on
+	if (pkt->ack) return;
+
+	// handshake: hand out a connection id, the reply carries it
+	// it is not acked, a lost reply makes the client send HELLO again
+	if (pkt->conn_id == 0) {
+		if (!strcmp(pkt->data, "HELLO")) {
+			// advertise the chunk store so clients know they can use dput
+			if ((sess = newSession(&pkt->from)) == NULL) {
+				// no reply, the client gives up once its HELLO goes unanswered
+				printf("server has no free session, HELLO ignored\n");
+				return;
+			}
+			sendReply(sockfd, dedup ? "HELLO DEDUP" : "HELLO", &sess->addr, sess->conn_id, 0, 0);
+			printf("server opened connection %08x\n", sess->conn_id);
+		}
+		return;
+	}
 
-		// for debugging
-		// printf("Got packet with number %d == %d with %d\n", r_byte_num, byte_num, n);
+	// unknown id, e.g. the server restarted, the client has to handshake again
+	if ((sess = lookupSession(pkt->conn_id)) == NULL) {
+		sendReply(sockfd, "BADCONN", &pkt->from, pkt->conn_id, pkt->req_id, 0);
+		return;
+	}
+
+	// the session follows the client if its address changes
+	sess->addr = pkt->from;
+	sess->last_seen = time(NULL);
+
+	if (pkt->req_id == sess->next_req && pkt->seq == 0) {
+		// a new command, left unacked while the queue is full so the client sends it again later
+		if (sess->queue_len == SESSION_QUEUE) return;
+
+		cmd = &sess->queue[(sess->queue_head + sess->queue_len) % SESSION_QUEUE];
+		cmd->req_id = pkt->req_id;
+		cmd->len = pkt->len;
+		memcpy(cmd->text, pkt->data, pkt->len + 1);
+		sess->queue_len++;
+		sess->next_req++;
+	}
+
+	// anything else was received before and the client missed our ack
+	sendAck(sockfd, pkt);
+}
+
+struct session* nextCommand(struct command* cmd) {
+	static int next = 0; // session to look at first, so sessions take turns
+	struct session* sess;
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		sess = &sessions[(next + i) % MAX_SESSIONS];
+		if (sess->conn_id == 0 || sess->queue_len == 0) continue;
+
+		*cmd = sess->queue[sess->queue_head];
+		sess->queue_head = (sess->queue_head + 1) % SESSION_QUEUE;
+		sess->queue_len--;
+		next = (next + i + 1) % MAX_SESSIONS;
+		return sess;
+	}
+	return NULL;
+}
+
+// sends a packet, resends if all bytes were not sent
+int sendPacket(char* buf, int len, int sockfd, struct session* sess) {
+	char send_buf[BUFSIZE+HDRSIZE]; // extra bytes to hold the trailer
+	struct packet pkt; // ack, or whatever else arrives meanwhile
+	unsigned int seq = sess->send_seq++;
+	int count = 0; // # of times we try to resend the data
+
+	// init send buffer
+	memcpy(send_buf, buf, len);
+	int send_len = addTrailer(send_buf, len, sess->conn_id, sess->req_id, seq);
+
+	// set timeout for recvfrom
+	setTimeout(sockfd, 0, 500000); // half a seocond
+
+	// for debugging
+	// printf("Sending packet %d %d\n", seq, len);
+
+	// send packet
+	send_packet_lbl:
+	sendto(sockfd, send_buf, send_len, 0, (struct sockaddr *) &sess->addr, sizeof(sess->addr));
 	
-	} while (r_byte_num != byte_num);
+	// wait for ACK from other computer
+	wait_ack_lbl:
+	if (readPacket(sockfd, &pkt) < 0) {
+		// timeout reached
+		// could have been a packet loss, retry unless too many
+		if (++count > 5) {
+			setTimeout(sockfd, 0, 0);
+			return -1;
+		}
+		goto send_packet_lbl;
+	}
+
+	// other requests and other clients, including this client's next commands
+	if (pkt.conn_id != sess->conn_id || pkt.req_id != sess->req_id) {
+		handleOther(sockfd, &pkt);
+		goto wait_ack_lbl;
+	}
+
+	if (pkt.ack) {
+		// an ack for an earlier packet is a late duplicate
+		if (pkt.seq != seq) goto wait_ack_lbl;
+	} else if (pkt.seq != sess->get_seq) {
+		// a repeat of a packet we already have, the client missed our ack
+		if (pkt.seq < sess->get_seq) sendAck(sockfd, &pkt);
+		goto wait_ack_lbl;
+	}
+	// otherwise the client's next packet, it only sends that once it has ours
+	// it is not acked, so the client sends it again for getPacket
+
+	// reply to wherever the client is now
+	sess->addr = pkt.from;
+	sess->last_seen = time(NULL);
+
+	// reset socket timeout
+	setTimeout(sockfd, 0, 0);
+	return len;
+}
+
+int getPacket(char* buf, int sockfd, struct session* sess) {
+	struct packet pkt;
+
+	while (1) {
+		if (readPacket(sockfd, &pkt) < 0) {
+			fprintf(stderr, "Server timed out\n");
+			return -1;
+		}
+
+		if (pkt.ack || pkt.conn_id != sess->conn_id || pkt.req_id != sess->req_id) {
+			handleOther(sockfd, &pkt);
+			continue;
+		}
+
+		// a packet from further ahead can not be sent before this one is acked
+		if (pkt.seq > sess->get_seq) continue;
+
+		// send ack, again for a repeat since the client missed the first one
+		sendAck(sockfd, &pkt);
+
+		// for debugging
+		// printf("Got packet with number %d == %d with %d\n", pkt.seq, sess->get_seq, pkt.len);
+
+		if (pkt.seq == sess->get_seq) break;
+	}
+
+	sess->get_seq++;
+	sess->addr = pkt.from;
+	sess->last_seen = time(NULL);
 
 	// copy over actual data to given buffer
-	memcpy(buf, get_buf, n-4);
+	memcpy(buf, pkt.data, pkt.len);
 
-	return n-4; // to correct for the byte number, no longer needed
-}
\ No newline at end of file
+	return pkt.len; // the trailer is no longer needed
+}
@@ -0,0 +1,296 @@
+/*
+ * uftp_store.c - content addressed chunk store for uploaded files
+ * see uftp_store.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "uftp_store.h"
+
+// path of a chunk, STORE_DIR/<hex>
+#define CHUNK_PATH_SIZE (sizeof(STORE_DIR) + HASH_HEX_SIZE)
+
+static void chunkPath(unsigned char hash[HASH_SIZE], char path[CHUNK_PATH_SIZE]) {
+	char hex[HASH_HEX_SIZE];
+
+	hashToHex(hash, hex);
+	snprintf(path, CHUNK_PATH_SIZE, "%s/%s", STORE_DIR, hex);
+}
+
+int storeInit(void) {
+	if (mkdir(STORE_DIR, 0755) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	return 0;
+}
+
+int storeHas(unsigned char hash[HASH_SIZE]) {
+	char path[CHUNK_PATH_SIZE];
+
+	chunkPath(hash, path);
+	return !access(path, F_OK);
+}
+
+int storeWrite(unsigned char hash[HASH_SIZE], unsigned char* data, size_t len) {
+	char path[CHUNK_PATH_SIZE];
+	char tmp_path[CHUNK_PATH_SIZE + 4];
+	unsigned char check[HASH_SIZE];
+	FILE* chunk;
+
+	// never store data under a name it does not hash to
+	sha256(data, len, check);
+	if (memcmp(check, hash, HASH_SIZE)) {
+		return -1;
+	}
+
+	chunkPath(hash, path);
+	if (!access(path, F_OK)) {
+		return 0;
+	}
+
+	// write aside then rename, so a chunk is either complete or absent
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	if ((chunk = fopen(tmp_path, "w")) == NULL) {
+		return -1;
+	}
+	if (fwrite(data, 1, len, chunk) != len) {
+		fclose(chunk);
+		remove(tmp_path);
+		return -1;
+	}
+	if (fclose(chunk) || rename(tmp_path, path)) {
+		remove(tmp_path);
+		return -1;
+	}
+	return 0;
+}
+
+FILE* storeOpenChunk(unsigned char hash[HASH_SIZE]) {
+	char path[CHUNK_PATH_SIZE];
+
+	chunkPath(hash, path);
+	return fopen(path, "r");
+}
+
+// hashes referenced by recipes, collected by storeSweep
+struct marks {
+	unsigned char* hashes; // HASH_SIZE bytes per hash
+	int count;
+	int cap; // hashes allocated
+};
+
+static int compareHash(const void* a, const void* b) {
+	return memcmp(a, b, HASH_SIZE);
+}
+
+// adds the chunks of one recipe to marks, returns -1 if it is malformed
+static int markRecipe(FILE* recipe, struct marks* m) {
+	unsigned char hash[HASH_SIZE];
+	unsigned int len;
+	int n;
+
+	while ((n = recipeNext(recipe, hash, &len)) > 0) {
+		if (m->count == m->cap) {
+			int new_cap = m->cap ? 2*m->cap : 1024;
+			unsigned char* new_hashes = realloc(m->hashes, new_cap * HASH_SIZE);
+			if (!new_hashes) return -1;
+			m->hashes = new_hashes;
+			m->cap = new_cap;
+		}
+		memcpy(m->hashes + m->count*HASH_SIZE, hash, HASH_SIZE);
+		m->count++;
+	}
+	return n;
+}
+
+int storeSweep(void) {
+	struct marks m = { NULL, 0, 0 };
+	unsigned char hash[HASH_SIZE];
+	char path[sizeof(STORE_DIR) + 256];
+	struct dirent* dir;
+	FILE* recipe;
+	DIR* d;
+	int removed = 0;
+
+	// mark: every chunk any recipe uses
+	if ((d = opendir(".")) == NULL) {
+		return -1;
+	}
+	while ((dir = readdir(d)) != NULL) {
+		if ((recipe = recipeOpen(dir->d_name)) == NULL) {
+			continue;
+		}
+		int n = markRecipe(recipe, &m);
+		fclose(recipe);
+		if (n < 0) {
+			closedir(d);
+			free(m.hashes);
+			return -1;
+		}
+	}
+	closedir(d);
+	if (m.count) {
+		qsort(m.hashes, m.count, HASH_SIZE, compareHash);
+	}
+
+	// sweep: anything in the store that is not a marked chunk, including
+	// temporary files left behind by an interrupted write
+	if ((d = opendir(STORE_DIR)) == NULL) {
+		free(m.hashes);
+		return -1;
+	}
+	while ((dir = readdir(d)) != NULL) {
+		if (!strcmp(dir->d_name, ".") || !strcmp(dir->d_name, "..")) {
+			continue;
+		}
+
+		if (strlen(dir->d_name) == HASH_HEX_SIZE - 1
+			&& strspn(dir->d_name, "0123456789abcdef") == HASH_HEX_SIZE - 1
+			&& hexToHash(dir->d_name, hash) == 0
+			&& bsearch(hash, m.hashes, m.count, HASH_SIZE, compareHash)) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", STORE_DIR, dir->d_name);
+		if (!remove(path)) {
+			removed++;
+		}
+	}
+	closedir(d);
+
+	free(m.hashes);
+	return removed;
+}
+
+// state while ingesting a file
+struct ingest {
+	FILE* recipe;
+	int failed;
+};
+
+static int ingestChunk(unsigned char* data, size_t len, void* arg) {
+	struct ingest* in = (struct ingest *) arg;
+	unsigned char hash[HASH_SIZE];
+	char hex[HASH_HEX_SIZE];
+
+	sha256(data, len, hash);
+	if (storeWrite(hash, data, len) < 0) {
+		in->failed = 1;
+		return -1;
+	}
+
+	hashToHex(hash, hex);
+	fprintf(in->recipe, "%s %zu\n", hex, len);
+	return 0;
+}
+
+int storeIngest(char* file_name) {
+	char tmp_name[300];
+	struct ingest in;
+	FILE* file;
+
+	if ((file = fopen(file_name, "r")) == NULL) {
+		return -1;
+	}
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.rcp.tmp", file_name);
+	if ((in.recipe = fopen(tmp_name, "w")) == NULL) {
+		fclose(file);
+		return -1;
+	}
+	in.failed = 0;
+
+	fputs(RECIPE_MAGIC, in.recipe);
+	int count = chunkFile(file, ingestChunk, &in);
+	fclose(file);
+
+	// on failure the plain file is left as it is
+	if (fclose(in.recipe) || count < 0 || in.failed || rename(tmp_name, file_name)) {
+		remove(tmp_name);
+		return -1;
+	}
+	return 0;
+}
+
+int recipeWrite(char* file_name, unsigned char* hashes, unsigned int* lens, int count) {
+	char tmp_name[300];
+	char hex[HASH_HEX_SIZE];
+	FILE* recipe;
+	int i;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.rcp.tmp", file_name);
+	if ((recipe = fopen(tmp_name, "w")) == NULL) {
+		return -1;
+	}
+
+	fputs(RECIPE_MAGIC, recipe);
+	for (i = 0; i < count; i++) {
+		hashToHex(hashes + i*HASH_SIZE, hex);
+		fprintf(recipe, "%s %u\n", hex, lens[i]);
+	}
+
+	if (fclose(recipe) || rename(tmp_name, file_name)) {
+		remove(tmp_name);
+		return -1;
+	}
+	return 0;
+}
+
+FILE* recipeOpen(char* file_name) {
+	char magic[sizeof(RECIPE_MAGIC)];
+	FILE* recipe;
+
+	if ((recipe = fopen(file_name, "r")) == NULL) {
+		return NULL;
+	}
+
+	if (fread(magic, 1, strlen(RECIPE_MAGIC), recipe) != strlen(RECIPE_MAGIC)
+		|| strncmp(magic, RECIPE_MAGIC, strlen(RECIPE_MAGIC))) {
+		fclose(recipe);
+		return NULL;
+	}
+	return recipe;
+}
+
+int recipeNext(FILE* recipe, unsigned char hash[HASH_SIZE], unsigned int* len) {
+	char hex[HASH_HEX_SIZE];
+	int n;
+
+	n = fscanf(recipe, "%64s %u", hex, len);
+	if (n == EOF) {
+		return 0;
+	}
+	if (n != 2 || hexToHash(hex, hash) < 0 || *len > CHUNK_MAX) {
+		return -1;
+	}
+	return 1;
+}
+
+int recipeCheck(FILE* recipe) {
+	unsigned char hash[HASH_SIZE];
+	char path[CHUNK_PATH_SIZE];
+	unsigned int len;
+	struct stat st;
+	long start = ftell(recipe);
+	int n;
+
+	while ((n = recipeNext(recipe, hash, &len)) > 0) {
+		chunkPath(hash, path);
+		if (stat(path, &st) < 0 || st.st_size != len) {
+			n = -1;
+			break;
+		}
+	}
+
+	if (fseek(recipe, start, SEEK_SET) < 0) {
+		return -1;
+	}
+	return n;
+}
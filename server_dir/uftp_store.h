@@ -0,0 +1,57 @@
+/*
+ * uftp_store.h - content addressed chunk store for uploaded files
+ *
+ * Every unique chunk is kept once under STORE_DIR, named by the hex of
+ * its hash. An uploaded file is replaced by a recipe listing the chunks
+ * that make it up, which get reassembles on the way out.
+ */
+
+#ifndef UFTP_STORE_H
+#define UFTP_STORE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "uftp_chunk.h"
+
+#define STORE_DIR ".chunks"
+
+// first line of every recipe, followed by one "<hash> <length>" line per chunk
+#define RECIPE_MAGIC "UFTPRCP1\n"
+
+// creates the store directory, returns -1 on failure
+int storeInit(void);
+
+// 1 if the chunk is in the store
+int storeHas(unsigned char hash[HASH_SIZE]);
+
+// adds a chunk to the store, returns -1 if data does not match hash or cannot be written
+int storeWrite(unsigned char hash[HASH_SIZE], unsigned char* data, size_t len);
+
+// opens a chunk for reading, NULL if it is missing
+FILE* storeOpenChunk(unsigned char hash[HASH_SIZE]);
+
+// chunks a plain file into the store and replaces it with its recipe
+int storeIngest(char* file_name);
+
+// writes the recipe for count chunks to file_name, replacing it
+int recipeWrite(char* file_name, unsigned char* hashes, unsigned int* lens, int count);
+
+// opens file_name positioned after the recipe header, NULL if it is not a recipe
+FILE* recipeOpen(char* file_name);
+
+// reads the next chunk of a recipe, returns 1, or 0 at the end, or -1 if malformed
+int recipeNext(FILE* recipe, unsigned char hash[HASH_SIZE], unsigned int* len);
+
+// removes every chunk no recipe in the current directory refers to, and any
+// leftover that is not a chunk, returns the number removed
+// nothing is removed and -1 is returned if a recipe can not be read, since
+// its chunks would be lost
+int storeSweep(void);
+
+// checks that every chunk of an open recipe is in the store with the listed length
+// returns -1 if one is missing, the wrong size or the recipe is malformed
+// the recipe is left positioned after its header either way
+int recipeCheck(FILE* recipe);
+
+#endif